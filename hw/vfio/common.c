@@ -34,6 +34,7 @@
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
 #include "qemu/range.h"
+#include "qemu/timer.h"
 #include "sysemu/kvm.h"
 #include "sysemu/reset.h"
 #include "trace.h"
@@ -367,6 +368,58 @@ static bool vfio_devices_all_running_and_saving(VFIOContainer *container)
     return true;
 }
 
+/*
+ * Record a failed DMA ioctl and schedule the report.  Producers and the
+ * draining bottom half all run under the BQL; the ring only exists to
+ * move the strerror()/stderr formatting off the map/unmap path, which
+ * matters when a misprogrammed guest triggers failures in bursts.  On
+ * overflow the record is dropped, the drain prints a summary anyway.
+ */
+static void vfio_dma_error_notify(VFIOContainer *container, bool map,
+                                  hwaddr iova, ram_addr_t size, int error)
+{
+    if (container->dma_error_head - container->dma_error_tail <
+        VFIO_DMA_ERROR_RING_SIZE) {
+        VFIODMAErrorRecord *rec =
+            &container->dma_errors[container->dma_error_head++ %
+                                   VFIO_DMA_ERROR_RING_SIZE];
+
+        rec->iova = iova;
+        rec->size = size;
+        rec->error = error;
+        rec->map = map;
+    }
+    qemu_bh_schedule(container->dma_error_bh);
+}
+
+static void vfio_dma_error_bh(void *opaque)
+{
+    VFIOContainer *container = opaque;
+    unsigned suppressed = 0;
+    int last_error = 0;
+
+    while (container->dma_error_tail != container->dma_error_head) {
+        VFIODMAErrorRecord *rec =
+            &container->dma_errors[container->dma_error_tail++ %
+                                   VFIO_DMA_ERROR_RING_SIZE];
+
+        /* only report the first of each run of identical errors */
+        if (rec->error == last_error) {
+            suppressed++;
+            continue;
+        }
+        last_error = rec->error;
+        error_report("%p: VFIO_%s_DMA failed: iova 0x%"HWADDR_PRIx
+                     " size 0x"RAM_ADDR_FMT": %s", container,
+                     rec->map ? "MAP" : "UNMAP", rec->iova, rec->size,
+                     strerror(-rec->error));
+    }
+
+    if (suppressed) {
+        error_report("%u similar DMA errors suppressed", suppressed);
+    }
+}
+
 static int vfio_dma_unmap_bitmap(VFIOContainer *container,
                                  hwaddr iova, ram_addr_t size,
                                  IOMMUTLBEntry *iotlb)
@@ -421,6 +474,17 @@ unmap_exit:
     return ret;
 }
 
+/* Out of line so the wrappers' success paths fall straight through */
+static __attribute__((cold, noinline))
+int vfio_dma_ioctl_failed(VFIOContainer *container, bool map,
+                          hwaddr iova, ram_addr_t size)
+{
+    int error = -errno; /* before qemu_bh_schedule() can clobber errno */
+
+    vfio_dma_error_notify(container, map, iova, size, error);
+    return error;
+}
+
 /*
  * DMA - Mapping and unmapping for the "type1" IOMMU interface used on x86
  */
@@ -428,19 +492,24 @@ static int vfio_dma_unmap(VFIOContainer *container,
                           hwaddr iova, ram_addr_t size,
                           IOMMUTLBEntry *iotlb)
 {
-    struct vfio_iommu_type1_dma_unmap unmap = {
+    /*
+     * The invariant fields are set up once per thread; each call only
+     * writes the ones that actually vary.
+     */
+    static __thread struct vfio_iommu_type1_dma_unmap unmap = {
         .argsz = sizeof(unmap),
         .flags = 0,
-        .iova = iova,
-        .size = size,
     };
 
+    unmap.iova = iova;
+    unmap.size = size;
+
     if (iotlb && container->dirty_pages_supported &&
         vfio_devices_all_running_and_saving(container)) {
         return vfio_dma_unmap_bitmap(container, iova, size, iotlb);
     }
 
-    while (ioctl(container->fd, VFIO_IOMMU_UNMAP_DMA, &unmap)) {
+    while (unlikely(ioctl(container->fd, VFIO_IOMMU_UNMAP_DMA, &unmap))) {
         /*
          * The type1 backend has an off-by-one bug in the kernel (71a7d3d78e3c
          * v4.15) where an overflow in its wrap-around check prevents us from
@@ -459,8 +528,7 @@ static int vfio_dma_unmap(VFIOContainer *container,
             unmap.size -= 1ULL << ctz64(container->pgsizes);
             continue;
         }
-        error_report("VFIO_UNMAP_DMA failed: %s", strerror(errno));
-        return -errno;
+        return vfio_dma_ioctl_failed(container, false, iova, size);
     }
 
     return 0;
@@ -468,32 +536,248 @@ static int vfio_dma_unmap(VFIOContainer *container,
 
 static int vfio_dma_map(VFIOContainer *container, hwaddr iova,
                         ram_addr_t size, void *vaddr, bool readonly)
+{
+    static __thread struct vfio_iommu_type1_dma_map map = {
+        .argsz = sizeof(map),
+    };
+
+    /*
+     * A single unconditional store; readonly follows the guest's mapping
+     * attributes, so a branch here is unpredictable in the map loop.
+     */
+    map.flags = VFIO_DMA_MAP_FLAG_READ |
+                (readonly ? 0 : VFIO_DMA_MAP_FLAG_WRITE);
+    map.vaddr = (__u64)(uintptr_t)vaddr;
+    map.iova = iova;
+    map.size = size;
+
+    if (likely(ioctl(container->fd, VFIO_IOMMU_MAP_DMA, &map) == 0)) {
+        return 0;
+    }
+
+    /*
+     * If the mapping failed with EBUSY, unmap the region and try again.
+     * This shouldn't be necessary, but we sometimes see it in the VGA
+     * ROM space.
+     */
+    if (errno == EBUSY && vfio_dma_unmap(container, iova, size, NULL) == 0 &&
+        ioctl(container->fd, VFIO_IOMMU_MAP_DMA, &map) == 0) {
+        return 0;
+    }
+
+    return vfio_dma_ioctl_failed(container, true, iova, size);
+}
+
+/*
+ * Fast path for the overwhelmingly common vIOMMU request: a 4K,
+ * read-write mapping.  The constant size and flags fold the struct
+ * setup into immediate stores.  Any failure falls back to the generic
+ * path so the EBUSY retry and error accounting stay in one place.
+ */
+static inline int vfio_dma_map_4k_rw(VFIOContainer *container, hwaddr iova,
+                                     void *vaddr)
 {
     struct vfio_iommu_type1_dma_map map = {
         .argsz = sizeof(map),
-        .flags = VFIO_DMA_MAP_FLAG_READ,
+        .flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE,
         .vaddr = (__u64)(uintptr_t)vaddr,
         .iova = iova,
-        .size = size,
+        .size = 4096,
     };
 
-    if (!readonly) {
-        map.flags |= VFIO_DMA_MAP_FLAG_WRITE;
+    if (likely(ioctl(container->fd, VFIO_IOMMU_MAP_DMA, &map) == 0)) {
+        return 0;
     }
+    return vfio_dma_map(container, iova, 4096, vaddr, false);
+}
+
+static void vfio_dma_batch_add(VFIODMABatch *batch, hwaddr iova,
+                               ram_addr_t size, void *vaddr, bool readonly)
+{
+    size_t i = batch->nr;
 
     /*
-     * Try the mapping, if it fails with EBUSY, unmap the region and try
-     * again.  This shouldn't be necessary, but we sometimes see it in
-     * the VGA ROM space.
+     * Replays hand us one entry per IOMMU page even when the underlying
+     * run is physically and virtually contiguous.  Extend the previous
+     * entry instead of appending, so a contiguous run costs one MAP_DMA
+     * instead of one per page.
      */
-    if (ioctl(container->fd, VFIO_IOMMU_MAP_DMA, &map) == 0 ||
-        (errno == EBUSY && vfio_dma_unmap(container, iova, size, NULL) == 0 &&
-         ioctl(container->fd, VFIO_IOMMU_MAP_DMA, &map) == 0)) {
-        return 0;
+    if (i && batch->iovas[i - 1] + batch->sizes[i - 1] == iova &&
+        (char *)batch->vaddrs[i - 1] + batch->sizes[i - 1] == vaddr &&
+        batch->readonly[i - 1] == readonly) {
+        batch->sizes[i - 1] += size;
+        return;
     }
 
-    error_report("VFIO_MAP_DMA failed: %s", strerror(errno));
-    return -errno;
+    if (i == batch->capacity) {
+        batch->capacity = batch->capacity ? batch->capacity * 2 : 64;
+        batch->iovas = g_renew(hwaddr, batch->iovas, batch->capacity);
+        batch->sizes = g_renew(ram_addr_t, batch->sizes, batch->capacity);
+        batch->vaddrs = g_renew(void *, batch->vaddrs, batch->capacity);
+        batch->readonly = g_renew(bool, batch->readonly, batch->capacity);
+    }
+
+    batch->iovas[i] = iova;
+    batch->sizes[i] = size;
+    batch->vaddrs[i] = vaddr;
+    batch->readonly[i] = readonly;
+    batch->nr = i + 1;
+}
+
+/*
+ * Submit all accumulated mappings to the host.  The type1 interface has no
+ * vectored MAP_DMA variant, so each entry still costs one ioctl; batching
+ * nevertheless keeps the mappings together so that adjacent entries can be
+ * merged before submission.  A mapping failure is reported through the
+ * container's error ring and does not stop the remaining entries, matching
+ * the per-entry replay behaviour.
+ */
+static int vfio_dma_batch_flush(VFIOContainer *container, VFIODMABatch *batch)
+{
+    int ret = 0;
+    size_t i;
+
+    trace_vfio_dma_batch_flush(batch->nr);
+
+    for (i = 0; i < batch->nr; i++) {
+        int ret1 = vfio_dma_map(container, batch->iovas[i], batch->sizes[i],
+                                batch->vaddrs[i], batch->readonly[i]);
+
+        if (ret1 && !ret) {
+            ret = ret1;
+        }
+    }
+
+    g_free(batch->iovas);
+    g_free(batch->sizes);
+    g_free(batch->vaddrs);
+    g_free(batch->readonly);
+    memset(batch, 0, sizeof(*batch));
+    return ret;
+}
+
+/*
+ * Limits for the non-strict unmap mode: how many deferred unmaps may be
+ * parked on the reuse cache and for how long, before the host mappings
+ * are torn down for real.
+ */
+#define VFIO_DMA_CACHE_MAX          256
+#define VFIO_DMA_UNMAP_TIMEOUT_MS   10
+
+/*
+ * Try to satisfy a guest IOMMU map request from the reuse cache.  An
+ * exact match against a deferred unmap revives the still-live host
+ * mapping without any ioctl.  Deferred entries that overlap the new
+ * mapping without matching it are unmapped for real first, so that the
+ * following MAP_DMA cannot collide with them.
+ */
+static bool vfio_dma_cache_map_reuse(VFIOContainer *container, hwaddr iova,
+                                     ram_addr_t size, void *vaddr,
+                                     bool readonly)
+{
+    VFIODMACacheEntry *entry, *tmp;
+
+    QLIST_FOREACH_SAFE(entry, &container->dma_deferred, next, tmp) {
+        if (entry->iova == iova && entry->size == size &&
+            entry->vaddr == vaddr && entry->readonly == readonly) {
+            QLIST_REMOVE(entry, next);
+            container->dma_cache_nr--;
+            g_hash_table_replace(container->dma_mapped, &entry->iova, entry);
+            return true;
+        }
+        if (ranges_overlap(entry->iova, entry->size, iova, size)) {
+            vfio_dma_unmap(container, entry->iova, entry->size, NULL);
+            QLIST_REMOVE(entry, next);
+            container->dma_cache_nr--;
+            g_free(entry);
+        }
+    }
+    return false;
+}
+
+/* Remember a guest IOMMU mapping so a later unmap of it can be deferred */
+static void vfio_dma_cache_record(VFIOContainer *container, hwaddr iova,
+                                  ram_addr_t size, void *vaddr, bool readonly)
+{
+    VFIODMACacheEntry *entry;
+
+    if (!container->dma_cache_max) {
+        return;
+    }
+
+    entry = g_new0(VFIODMACacheEntry, 1);
+    entry->iova = iova;
+    entry->size = size;
+    entry->vaddr = vaddr;
+    entry->readonly = readonly;
+    /*
+     * A remap over a tracked iova (e.g. the EBUSY unmap-and-retry path)
+     * supersedes the stale entry instead of duplicating it.
+     */
+    g_hash_table_replace(container->dma_mapped, &entry->iova, entry);
+}
+
+/* Unmap all deferred entries, ending their reuse window */
+static void vfio_dma_cache_flush_deferred(VFIOContainer *container)
+{
+    VFIODMACacheEntry *entry, *tmp;
+
+    QLIST_FOREACH_SAFE(entry, &container->dma_deferred, next, tmp) {
+        vfio_dma_unmap(container, entry->iova, entry->size, NULL);
+        QLIST_REMOVE(entry, next);
+        g_free(entry);
+    }
+    container->dma_cache_nr = 0;
+    if (container->unmap_timer) {
+        timer_del(container->unmap_timer);
+    }
+}
+
+static void vfio_dma_unmap_timer(void *opaque)
+{
+    VFIOContainer *container = opaque;
+
+    vfio_dma_cache_flush_deferred(container);
+}
+
+/*
+ * Defer a guest IOMMU unmap, keeping the host mapping alive for reuse.
+ * Returns false if the mapping is not tracked, in which case the caller
+ * must unmap for real.  A full cache is flushed as a whole before the
+ * new entry is parked, and the first deferred entry arms a timer that
+ * bounds how long the stale host mappings may linger.
+ */
+static bool vfio_dma_cache_defer_unmap(VFIOContainer *container, hwaddr iova,
+                                       ram_addr_t size)
+{
+    VFIODMACacheEntry *entry = g_hash_table_lookup(container->dma_mapped,
+                                                   &iova);
+
+    if (!entry || entry->size != size) {
+        return false;
+    }
+    g_hash_table_steal(container->dma_mapped, &entry->iova);
+    if (container->dma_cache_nr >= container->dma_cache_max) {
+        vfio_dma_cache_flush_deferred(container);
+    }
+    QLIST_INSERT_HEAD(&container->dma_deferred, entry, next);
+    if (!container->dma_cache_nr++ && container->unmap_timer) {
+        /*
+         * The lingering window is a host-side isolation bound, it must
+         * not stretch while the VM is paused: real time, not guest time.
+         */
+        timer_mod(container->unmap_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                  VFIO_DMA_UNMAP_TIMEOUT_MS);
+    }
+    return true;
+}
+
+/* Unmap all deferred entries and forget every tracked mapping */
+static void vfio_dma_cache_reset(VFIOContainer *container)
+{
+    vfio_dma_cache_flush_deferred(container);
+    g_hash_table_remove_all(container->dma_mapped);
 }
 
 static void vfio_host_win_add(VFIOContainer *container,
@@ -599,17 +883,38 @@ static bool vfio_get_xlat_addr(IOMMUTLBEntry *iotlb, void **vaddr,
 static void vfio_iommu_unmap_notify(IOMMUNotifier *n, IOMMUTLBEntry *iotlb)
 {
     VFIOGuestIOMMU *giommu = container_of(n, VFIOGuestIOMMU, n);
-    struct vfio_iommu_type1_cache_invalidate ustruct = {};
+    /*
+     * The request template never varies: only the granularity and the
+     * granu union are rewritten per invalidation, the rest is set up
+     * once per thread.
+     */
+    static __thread struct vfio_iommu_type1_cache_invalidate ustruct = {
+        .argsz = sizeof(ustruct),
+        .flags = 0,
+        .info.argsz = sizeof(struct iommu_cache_invalidate_info),
+        .info.version = IOMMU_CACHE_INVALIDATE_INFO_VERSION_1,
+        .info.cache = IOMMU_CACHE_INV_TYPE_IOTLB,
+    };
     VFIOContainer *container = giommu->container;
     int ret;
 
     assert(iotlb->perm == IOMMU_NONE);
 
-    ustruct.argsz = sizeof(ustruct);
-    ustruct.flags = 0;
-    ustruct.info.argsz = sizeof(struct iommu_cache_invalidate_info);
-    ustruct.info.version = IOMMU_CACHE_INVALIDATE_INFO_VERSION_1;
-    ustruct.info.cache = IOMMU_CACHE_INV_TYPE_IOTLB;
+    /*
+     * The type1 interface has no way to query up front whether the host
+     * implements this ioctl, so probe lazily: once the kernel has
+     * answered ENOTTY, stop paying an ioctl (and a report) for every
+     * guest IOTLB invalidation.  Only the ioctl being absent may latch
+     * this off; a host that rejects one granularity can still service
+     * the others, and dropping those would leave stale host translations
+     * live behind the guest's back.
+     */
+    if (!container->cache_inval_supported) {
+        return;
+    }
+
+    /* the granu fields below are or'ed in, clear the previous request */
+    memset(&ustruct.info.granu, 0, sizeof(ustruct.info.granu));
 
     switch (iotlb->granularity) {
     case IOMMU_INV_GRAN_DOMAIN:
@@ -658,6 +963,12 @@ static void vfio_iommu_unmap_notify(IOMMUNotifier *n, IOMMUTLBEntry *iotlb)
 
     ret = ioctl(container->fd, VFIO_IOMMU_CACHE_INVALIDATE, &ustruct);
     if (ret) {
+        if (errno == ENOTTY) {
+            error_report("%p: host does not implement CACHE invalidation, "
+                         "disabling it", container);
+            container->cache_inval_supported = false;
+            return;
+        }
         error_report("%p: failed to invalidate CACHE (%d)", container, ret);
     }
 }
@@ -753,23 +1064,40 @@ static void vfio_iommu_map_notify(IOMMUNotifier *n, IOMMUTLBEntry *iotlb)
          * of vaddr will always be there, even if the memory object is
          * destroyed and its backing memory munmap-ed.
          */
-        ret = vfio_dma_map(container, iova,
-                           iotlb->addr_mask + 1, vaddr,
-                           read_only);
-        if (ret) {
-            error_report("vfio_dma_map(%p, 0x%"HWADDR_PRIx", "
-                         "0x%"HWADDR_PRIx", %p) = %d (%m)",
-                         container, iova,
-                         iotlb->addr_mask + 1, vaddr, ret);
+        if (vfio_dma_cache_map_reuse(container, iova, iotlb->addr_mask + 1,
+                                     vaddr, read_only)) {
+            goto out;
+        }
+        if (container->map_batch) {
+            vfio_dma_batch_add(container->map_batch, iova,
+                               iotlb->addr_mask + 1, vaddr, read_only);
+            goto out;
+        }
+        if (iotlb->addr_mask == 4096 - 1 && !read_only) {
+            ret = vfio_dma_map_4k_rw(container, iova, vaddr);
+        } else {
+            ret = vfio_dma_map(container, iova,
+                               iotlb->addr_mask + 1, vaddr,
+                               read_only);
+        }
+        /* a failure has been recorded in the container's error ring */
+        if (!ret) {
+            vfio_dma_cache_record(container, iova, iotlb->addr_mask + 1,
+                                  vaddr, read_only);
         }
     } else {
-        ret = vfio_dma_unmap(container, iova, iotlb->addr_mask + 1, iotlb);
-        if (ret) {
-            error_report("vfio_dma_unmap(%p, 0x%"HWADDR_PRIx", "
-                         "0x%"HWADDR_PRIx") = %d (%m)",
-                         container, iova,
-                         iotlb->addr_mask + 1, ret);
+        /*
+         * Don't defer the unmap while dirty pages are being collected,
+         * the UNMAP_DMA ioctl is what retrieves the bitmap.
+         */
+        if (!(container->dirty_pages_supported &&
+              vfio_devices_all_running_and_saving(container)) &&
+            vfio_dma_cache_defer_unmap(container, iova,
+                                       iotlb->addr_mask + 1)) {
+            goto out;
         }
+        /* a failure is recorded in the container's error ring */
+        vfio_dma_unmap(container, iova, iotlb->addr_mask + 1, iotlb);
     }
 out:
     rcu_read_unlock();
@@ -849,13 +1177,19 @@ static int vfio_dma_map_ram_section(VFIOContainer *container,
     return 0;
 }
 
+static void vfio_dma_unmap_ram_range(VFIOContainer *container, hwaddr iova,
+                                     hwaddr size)
+{
+    /* a failure is recorded in the container's error ring */
+    vfio_dma_unmap(container, iova, size, NULL);
+}
+
 static void vfio_dma_unmap_ram_section(VFIOContainer *container,
                                        MemoryRegionSection *section)
 {
     Int128 llend, llsize;
     hwaddr iova, end;
     bool try_unmap = true;
-    int ret;
 
     iova = REAL_HOST_PAGE_ALIGN(section->offset_within_address_space);
     llend = int128_make64(section->offset_within_address_space);
@@ -885,20 +1219,10 @@ static void vfio_dma_unmap_ram_section(VFIOContainer *container,
         if (int128_eq(llsize, int128_2_64())) {
             /* The unmap ioctl doesn't accept a full 64-bit span. */
             llsize = int128_rshift(llsize, 1);
-            ret = vfio_dma_unmap(container, iova, int128_get64(llsize), NULL);
-            if (ret) {
-                error_report("vfio_dma_unmap(%p, 0x%"HWADDR_PRIx", "
-                             "0x%"HWADDR_PRIx") = %d (%m)",
-                             container, iova, int128_get64(llsize), ret);
-            }
+            vfio_dma_unmap_ram_range(container, iova, int128_get64(llsize));
             iova += int128_get64(llsize);
         }
-        ret = vfio_dma_unmap(container, iova, int128_get64(llsize), NULL);
-        if (ret) {
-            error_report("vfio_dma_unmap(%p, 0x%"HWADDR_PRIx", "
-                         "0x%"HWADDR_PRIx") = %d (%m)",
-                         container, iova, int128_get64(llsize), ret);
-        }
+        vfio_dma_unmap_ram_range(container, iova, int128_get64(llsize));
     }
 }
 
@@ -1088,7 +1412,20 @@ static void vfio_listener_region_add(MemoryListener *listener,
         }
         QLIST_INSERT_HEAD(&container->giommu_list, giommu, giommu_next);
         if (flags & IOMMU_NOTIFIER_MAP) {
+            VFIODMABatch batch = {};
+
+            /*
+             * Batch the mappings triggered by the replay and submit them
+             * in one go afterwards.  The RCU read lock is held across the
+             * flush because the translated vaddrs are not pinned by the
+             * kernel until the deferred vfio_dma_map() runs.
+             */
+            rcu_read_lock();
+            container->map_batch = &batch;
             memory_region_iommu_replay(giommu->iommu, &giommu->n);
+            container->map_batch = NULL;
+            vfio_dma_batch_flush(container, &batch);
+            rcu_read_unlock();
         }
 
         return;
@@ -1166,6 +1503,13 @@ static void vfio_listener_region_del(MemoryListener *listener,
          * based IOMMU where a big unmap flattens a large range of IO-PTEs.
          * That may not be true for all IOMMU types.
          */
+
+        /*
+         * The reuse cache tracks mappings created through this IOMMU's
+         * notifier; flush it before the big unmap below invalidates them
+         * behind its back.
+         */
+        vfio_dma_cache_reset(container);
     }
 
     vfio_dma_unmap_ram_section(container, section);
@@ -1209,6 +1553,12 @@ static void vfio_listener_log_global_start(MemoryListener *listener)
 {
     VFIOContainer *container = container_of(listener, VFIOContainer, listener);
 
+    /*
+     * Unmaps deferred up to this point would later be flushed without
+     * retrieving their dirty bitmap.  Tear them down now, while the
+     * migration bitmap still considers every page dirty.
+     */
+    vfio_dma_cache_flush_deferred(container);
     vfio_set_dirty_page_tracking(container, true);
 }
 
@@ -2036,8 +2386,13 @@ static int vfio_connect_container(VFIOGroup *group, AddressSpace *as,
     container->fd = fd;
     container->error = NULL;
     container->dirty_pages_supported = false;
+    container->cache_inval_supported = true;
     QLIST_INIT(&container->giommu_list);
     QLIST_INIT(&container->hostwin_list);
+    container->dma_mapped = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                                  NULL, g_free);
+    QLIST_INIT(&container->dma_deferred);
+    container->dma_error_bh = qemu_bh_new(vfio_dma_error_bh, container);
 
     ret = vfio_init_container(container, group->fd, nested, &vmid, errp);
     if (ret) {
@@ -2191,6 +2546,8 @@ listener_release_exit:
     vfio_listener_release(container);
 
 free_container_exit:
+    qemu_bh_delete(container->dma_error_bh);
+    g_hash_table_destroy(container->dma_mapped);
     g_free(container);
 
 close_fd_exit:
@@ -2230,6 +2587,15 @@ static void vfio_disconnect_container(VFIOGroup *group)
 
         QLIST_REMOVE(container, next);
 
+        vfio_dma_cache_reset(container);
+        g_hash_table_destroy(container->dma_mapped);
+        if (container->unmap_timer) {
+            timer_free(container->unmap_timer);
+        }
+        /* report anything still pending before the ring goes away */
+        vfio_dma_error_bh(container);
+        qemu_bh_delete(container->dma_error_bh);
+
         QLIST_FOREACH_SAFE(giommu, &container->giommu_list, giommu_next, tmp) {
             memory_region_unregister_iommu_notifier(
                     MEMORY_REGION(giommu->iommu), &giommu->n);
@@ -2333,6 +2699,18 @@ void vfio_put_group(VFIOGroup *group)
     }
 }
 
+static bool vfio_container_has_device(VFIOContainer *container)
+{
+    VFIOGroup *group;
+
+    QLIST_FOREACH(group, &container->group_list, container_next) {
+        if (!QLIST_EMPTY(&group->device_list)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 int vfio_get_device(VFIOGroup *group, const char *name,
                     VFIODevice *vbasedev, Error **errp)
 {
@@ -2377,6 +2755,41 @@ int vfio_get_device(VFIOGroup *group, const char *name,
         }
     }
 
+    /*
+     * The reuse cache revives deferred host mappings on the assumption
+     * that the backing pages at the pinned vaddr are unchanged.  A device
+     * operating with RAM discarding can have the range discarded and
+     * re-populated in between, leaving the revived pin on stale pages.
+     */
+    if (vbasedev->dma_unmap_nonstrict && vbasedev->ram_block_discard_allowed) {
+        error_setg(errp, "x-dma-unmap-nonstrict is incompatible with "
+                   "discarding of RAM (e.g., balloon)");
+        close(fd);
+        return -1;
+    }
+
+    /*
+     * Non-strict DMA unmap trades isolation for speed: the host mapping
+     * of a translation the guest tore down may outlive the unmap request
+     * for a bounded window.  Enabling it switches the whole container,
+     * so, like the discard setting above, it must be requested
+     * consistently by every device sharing the IOMMU context.
+     */
+    if (vbasedev->dma_unmap_nonstrict != !!group->container->dma_cache_max &&
+        vfio_container_has_device(group->container)) {
+        error_setg(errp, "Inconsistent setting of x-dma-unmap-nonstrict "
+                   "within container");
+        close(fd);
+        return -1;
+    }
+    if (vbasedev->dma_unmap_nonstrict && !group->container->dma_cache_max) {
+        VFIOContainer *container = group->container;
+
+        container->unmap_timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                              vfio_dma_unmap_timer, container);
+        container->dma_cache_max = VFIO_DMA_CACHE_MAX;
+    }
+
     vbasedev->fd = fd;
     vbasedev->group = group;
     QLIST_INSERT_HEAD(&group->device_list, vbasedev, next);
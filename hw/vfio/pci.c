@@ -2672,10 +2672,12 @@ out:
 static void vfio_init_fault_response_regions(VFIOPCIDevice *vdev, Error **errp)
 {
     struct vfio_region_info *fault_region_info = NULL;
+    struct vfio_region_dma_fault_response header;
     struct vfio_region_info_cap_fault *cap_fault;
     VFIODevice *vbasedev = &vdev->vbasedev;
     struct vfio_info_cap_header *hdr;
     char *fault_region_name;
+    ssize_t bytes;
     int ret;
 
     ret = vfio_get_dev_region_info(&vdev->vbasedev,
@@ -2719,7 +2721,22 @@ static void vfio_init_fault_response_regions(VFIOPCIDevice *vdev, Error **errp)
     ret = vfio_region_mmap(&vdev->dma_fault_response_region);
     if (ret) {
         error_setg_errno(errp, -ret, "Failed to mmap the DMA FAULT RESPONSE queue");
+        goto out;
+    }
+
+    /*
+     * The queue geometry is fixed for the lifetime of the region: read it
+     * once so that returning a response does not need to re-read the
+     * header on every fault.
+     */
+    bytes = pread(vbasedev->fd, &header, sizeof(header),
+                  vdev->dma_fault_response_region.fd_offset);
+    if (bytes != sizeof(header)) {
+        error_setg(errp, "unable to read the fault response region header");
+        goto out;
     }
+    vdev->fault_response_nb_entries = header.nb_entries;
+    vdev->fault_response_entry_size = header.entry_size;
 out:
     g_free(fault_region_info);
 }
@@ -2998,6 +3015,29 @@ static int vfio_iommu_return_page_response(PCIBus *bus, int32_t devfn,
         return -EINVAL;
     }
 
+    /*
+     * Fast path: the queue is mmapped and its geometry was cached at init
+     * time, so the response is deposited directly and the only syscall
+     * left is the head index doorbell write.
+     */
+    queue = (struct iommu_page_response *)
+                vdev->dma_fault_response_region.mmaps[0].mmap;
+    if (queue && vdev->fault_response_nb_entries) {
+        memcpy(queue + vdev->fault_response_head_index, response,
+               vdev->fault_response_entry_size);
+
+        vdev->fault_response_head_index =
+            (vdev->fault_response_head_index + 1) %
+            vdev->fault_response_nb_entries;
+        bytes = pwrite(vdev->vbasedev.fd, &vdev->fault_response_head_index, 4,
+                       vdev->dma_fault_response_region.fd_offset);
+        if (bytes != 4) {
+            error_report("%s unable to write the fault response region head "
+                         "index (0x%lx)", __func__, bytes);
+        }
+        return 0;
+    }
+
     /* read the header */
     bytes = pread(vdev->vbasedev.fd, &header, sizeof(header),
                   vdev->dma_fault_response_region.fd_offset);
@@ -3626,6 +3666,8 @@ static Property vfio_pci_dev_properties[] = {
     DEFINE_PROP_BOOL("x-no-mmap", VFIOPCIDevice, vbasedev.no_mmap, false),
     DEFINE_PROP_BOOL("x-balloon-allowed", VFIOPCIDevice,
                      vbasedev.ram_block_discard_allowed, false),
+    DEFINE_PROP_BOOL("x-dma-unmap-nonstrict", VFIOPCIDevice,
+                     vbasedev.dma_unmap_nonstrict, false),
     DEFINE_PROP_BOOL("x-no-kvm-intx", VFIOPCIDevice, no_kvm_intx, false),
     DEFINE_PROP_BOOL("x-no-kvm-msi", VFIOPCIDevice, no_kvm_msi, false),
     DEFINE_PROP_BOOL("x-no-kvm-msix", VFIOPCIDevice, no_kvm_msix, false),
@@ -149,6 +149,9 @@ struct VFIOPCIDevice {
     uint32_t fault_tail_index;
     VFIORegion dma_fault_response_region;
     uint32_t fault_response_head_index;
+    /* queue geometry, cached so responses don't re-read the header */
+    uint32_t fault_response_nb_entries;
+    uint32_t fault_response_entry_size;
     int (*resetfn)(struct VFIOPCIDevice *);
     uint32_t vendor_id;
     uint32_t device_id;
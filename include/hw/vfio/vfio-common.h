@@ -82,20 +82,91 @@ typedef struct VFIOMSIBinding {
     QLIST_ENTRY(VFIOMSIBinding) next;
 } VFIOMSIBinding;
 
+/*
+ * Accumulates DMA mappings so that a burst of map requests, such as the
+ * replay of a guest IOMMU address space, can be submitted to the host in
+ * one go instead of one ioctl per translation entry.  The fields are kept
+ * in parallel arrays rather than an array of structs: appending an entry
+ * then touches four independent streams instead of dirtying interleaved
+ * cache lines, which matters when a replay builds tens of thousands of
+ * entries back to back.
+ */
+typedef struct VFIODMABatch {
+    hwaddr *iovas;
+    ram_addr_t *sizes;
+    void **vaddrs;
+    bool *readonly;
+    size_t nr;
+    size_t capacity;
+} VFIODMABatch;
+
+typedef struct VFIODMACacheEntry {
+    hwaddr iova;
+    ram_addr_t size;
+    void *vaddr;
+    bool readonly;
+    QLIST_ENTRY(VFIODMACacheEntry) next;
+} VFIODMACacheEntry;
+
+typedef struct VFIODMAErrorRecord {
+    hwaddr iova;
+    ram_addr_t size;
+    int error; /* negative errno */
+    bool map;  /* MAP_DMA or UNMAP_DMA */
+} VFIODMAErrorRecord;
+
+#define VFIO_DMA_ERROR_RING_SIZE 64
+
 struct VFIOGroup;
 
 typedef struct VFIOContainer {
-    VFIOAddressSpace *space;
-    int fd; /* /dev/vfio/vfio, empowered by the attached groups */
-    MemoryListener listener;
-    MemoryListener prereg_listener;
+    /*
+     * Read-mostly state consumed by every DMA ioctl.  It sits on its own
+     * cache line so that concurrent map/unmap issuers are not invalidated
+     * by the frequently written batching and bookkeeping state below.
+     */
+    /*
+     * /dev/vfio/vfio, empowered by the attached groups.  Written once at
+     * container creation, before any listener can run, and immutable for
+     * the container's lifetime: the DMA paths read it with no locking.
+     */
+    int fd;
     unsigned iommu_type;
-    Error *error;
     bool initialized;
     bool dirty_pages_supported;
+    bool cache_inval_supported;
+    unsigned long pgsizes;
     uint64_t dirty_pgsizes;
     uint64_t max_dirty_bitmap_size;
-    unsigned long pgsizes;
+    VFIOAddressSpace *space;
+    Error *error;
+
+    /* Frequently written fast-path state */
+    VFIODMABatch *map_batch QEMU_ALIGNED(64); /* set while building a batch */
+    /*
+     * Reuse cache for guest IOMMU mappings: unmaps requested by the guest
+     * are deferred and the host mapping is revived if the guest re-installs
+     * the identical translation, saving both the UNMAP and MAP ioctls.
+     * Disabled while dma_cache_max is 0.
+     */
+    unsigned dma_cache_max;
+    unsigned dma_cache_nr;
+    GHashTable *dma_mapped; /* iova -> VFIODMACacheEntry */
+    QLIST_HEAD(, VFIODMACacheEntry) dma_deferred;
+    QEMUTimer *unmap_timer; /* bounds how long deferred unmaps linger */
+    /*
+     * Failed DMA ioctls are recorded here and reported from a bottom
+     * half, keeping strerror()/stderr formatting off the hot path when a
+     * misbehaving guest triggers a burst of failures.
+     */
+    VFIODMAErrorRecord dma_errors[VFIO_DMA_ERROR_RING_SIZE];
+    unsigned dma_error_head;
+    unsigned dma_error_tail;
+    QEMUBH *dma_error_bh;
+
+    /* Cold configuration and list membership */
+    MemoryListener listener;
+    MemoryListener prereg_listener;
     QLIST_HEAD(, VFIOGuestIOMMU) giommu_list;
     QLIST_HEAD(, VFIOHostDMAWindow) hostwin_list;
     QLIST_HEAD(, VFIOGroup) group_list;
@@ -132,6 +203,7 @@ typedef struct VFIODevice {
     bool needs_reset;
     bool no_mmap;
     bool ram_block_discard_allowed;
+    bool dma_unmap_nonstrict;
     bool enable_migration;
     VFIODeviceOps *ops;
     unsigned int num_irqs;